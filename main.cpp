@@ -5,6 +5,22 @@
 #include <iostream>
 #include <fstream>
 #include <iomanip>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
+#include <string_view>
+#include <charconv>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
 
 using namespace std;
 
@@ -12,6 +28,7 @@ using namespace std;
 #ifndef WX_PRECOMP
     #include <wx/wx.h>
 #endif
+#include <wx/dcbuffer.h>
 
 
 // Функции для проверки клика в треугольник
@@ -95,15 +112,257 @@ public:
     std::string getError() const { return m_error; }
 };
 
+// Буфер для компактной записи сцены
+// Целые числа пишутся как varint (7 бит на байт), знаковые - через zig-zag
+class CompactWriter
+{
+private:
+    std::string _data;
+public:
+    void PutByte(uint8_t value) {
+        _data.push_back((char)value);
+    };
+    void PutVarint(uint64_t value) {
+        while(value >= 0x80) {
+            _data.push_back((char)(value | 0x80));
+            value >>= 7;
+        }
+        _data.push_back((char)value);
+    };
+    void PutSigned(int64_t value) {
+        PutVarint(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    };
+    // Дробные числа пишутся как 4 байта IEEE 754 в порядке little-endian независимо от процессора
+    void PutFloat(float value) {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        for(int i = 0; i < 4; i++) {
+            _data.push_back((char)(bits >> (i * 8)));
+        }
+    };
+    void PutBytes(const char* bytes, size_t size) {
+        _data.append(bytes, size);
+    };
+    const std::string& GetData() {
+        return _data;
+    };
+};
+
+// Чтение компактной записи сцены из буфера в памяти
+class CompactReader
+{
+private:
+    const char* _pos;
+    const char* _end;
+
+    void need(size_t size) {
+        if((size_t)(_end - _pos) < size) {
+            throw LoadException("файл обрывается на середине записи");
+        }
+    };
+public:
+    CompactReader(const std::string& data): _pos(data.data()), _end(data.data() + data.size()) {};
+    bool AtEnd() {
+        return _pos == _end;
+    };
+    uint8_t GetByte() {
+        need(1);
+        return (uint8_t)*_pos++;
+    };
+    uint64_t GetVarint() {
+        uint64_t value = 0;
+        for(int shift = 0; shift < 64; shift += 7) {
+            uint8_t b = GetByte();
+            value |= (uint64_t)(b & 0x7F) << shift;
+            if(!(b & 0x80)) {
+                return value;
+            }
+        }
+        throw LoadException("слишком длинное число");
+    };
+    int64_t GetSigned() {
+        uint64_t value = GetVarint();
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    };
+    float GetFloat() {
+        need(4);
+        uint32_t bits = 0;
+        for(int i = 0; i < 4; i++) {
+            bits |= (uint32_t)(uint8_t)*_pos++ << (i * 8);
+        }
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    };
+    bool Expect(const char* bytes, size_t size) {
+        if((size_t)(_end - _pos) < size || memcmp(_pos, bytes, size) != 0) {
+            return false;
+        }
+        _pos += size;
+        return true;
+    };
+};
+
+// Арена для фигур
+// Создание фигуры - сдвиг указателя внутри блока, очистка всей сцены - сброс указателя.
+// Блоки не возвращаются системе и переиспользуются следующей сценой,
+// поэтому при перезагрузках память не растёт
+class FigureArena
+{
+private:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+    vector<unique_ptr<char[]>> _blocks;
+    // Текущий блок и занятое место в нём
+    size_t _block = 0;
+    size_t _offset = 0;
+    size_t _used = 0;
+    size_t _count = 0;
+
+    void* allocate(size_t size, size_t align) {
+        while(true) {
+            if(_block < _blocks.size()) {
+                size_t offset = (_offset + align - 1) & ~(align - 1);
+                if(offset + size <= BLOCK_SIZE) {
+                    _offset = offset + size;
+                    _used += size;
+                    _count++;
+                    return _blocks[_block].get() + offset;
+                }
+                _block++;
+                _offset = 0;
+                continue;
+            }
+            _blocks.push_back(unique_ptr<char[]>(new char[BLOCK_SIZE]));
+        }
+    };
+public:
+    // Деструкторы не вызываются, поэтому в арене могут жить только объекты без ресурсов
+    template<typename T, typename... Args>
+    T* Create(Args&&... args) {
+        static_assert(is_trivially_destructible_v<T>, "объекты в арене не разрушаются");
+        static_assert(sizeof(T) <= BLOCK_SIZE, "объект больше блока арены");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    };
+    // Освобождает все объекты сразу, все указатели на них становятся недействительными
+    void Clear() {
+        _block = 0;
+        _offset = 0;
+        _used = 0;
+        _count = 0;
+    };
+    size_t GetCount() {
+        return _count;
+    };
+    size_t GetUsedBytes() {
+        return _used;
+    };
+    size_t GetReservedBytes() {
+        return _blocks.size() * BLOCK_SIZE;
+    };
+};
+
 // Кисть для закраски фигур
 wxBrush* brush = new wxBrush(*(new wxColour((unsigned long)rand())));
 
+class Figure;
+// Вызывается перед каждым изменением фигуры: фоновое сохранение успевает скопировать старое состояние
+void beforeFigureChange(Figure* figure);
+// То же перед изменением положения или размеров: буфер выбора ещё отмечает место, где фигура была, как повреждённое.
+// Цвет и Z в буфер выбора не попадают, порядок фигур при переносе вперёд обновляют moveToFront и addFigure
+void beforeShapeChange(Figure* figure);
+
+// Буфер выбора: для каждого пикселя канваса номер видимой в нём фигуры (индекс в figures + 1, 0 - пусто)
+// Фигуры рисуются в него теми же целочисленными координатами, что и на канвасе, от дальнего Z к ближнему,
+// поэтому поиск фигуры под курсором - чтение одного пикселя.
+// Перерисовывается только повреждённая область: места, где изменённые фигуры были и куда они попали.
+// Во время анимации меняется весь канвас, поэтому тогда используется обычный поиск через IsClicked
+class PickBuffer
+{
+private:
+    int _width = 0, _height = 0;
+    vector<int32_t> _ids;
+    // Область, которую нужно перерисовать, и фигуры, новое место которых тоже нужно перерисовать
+    wxRect _damage;
+    vector<Figure*> _changed;
+    bool _dirtyAll = true;
+    // Область, которой ограничено рисование при обновлении
+    wxRect _clip;
+
+    void addDamage(const wxRect &rect) {
+        if(rect.IsEmpty()) {
+            return;
+        }
+        _damage = _damage.IsEmpty() ? rect : _damage.Union(rect);
+    };
+    void update(Figure** figures, int figuresCount);
+public:
+    void Resize(int width, int height) {
+        if(width == _width && height == _height) {
+            return;
+        }
+        _width = max(0, width);
+        _height = max(0, height);
+        _ids.assign((size_t)_width * _height, 0);
+        InvalidateAll();
+    };
+    // Перерисовать весь буфер, например после загрузки или очистки сцены
+    void InvalidateAll() {
+        _dirtyAll = true;
+        _damage = wxRect();
+        _changed.clear();
+    };
+    void Invalidate(Figure* figure);
+    // Фигура под точкой (x, y) или nullptr
+    Figure* Pick(int x, int y, Figure** figures, int figuresCount) {
+        update(figures, figuresCount);
+        if(x < 0 || y < 0 || x >= _width || y >= _height) {
+            return nullptr;
+        }
+        int32_t id = _ids[(size_t)y * _width + x];
+        return id > 0 && id <= figuresCount ? figures[id - 1] : nullptr;
+    };
+
+    // Примитивы для Figure::DrawIds, ограничены областью обновления
+    void FillRect(int x, int y, int w, int h, int32_t id) {
+        int left = max(x, _clip.GetLeft()), right = min(x + w - 1, _clip.GetRight());
+        int top = max(y, _clip.GetTop()), bottom = min(y + h - 1, _clip.GetBottom());
+        for(int row = top; row <= bottom; row++) {
+            if(left <= right) {
+                fill(_ids.begin() + (size_t)row * _width + left, _ids.begin() + (size_t)row * _width + right + 1, id);
+            }
+        }
+    };
+    void FillCircle(int cx, int cy, int r, int32_t id) {
+        int top = max(cy - r, _clip.GetTop()), bottom = min(cy + r, _clip.GetBottom());
+        for(int row = top; row <= bottom; row++) {
+            int dy = row - cy;
+            int half = sqrt((double)r * r + r - dy * dy);
+            FillRect(cx - half, row, half * 2 + 1, 1, id);
+        }
+    };
+    void FillTriangle(wxPoint p1, wxPoint p2, wxPoint p3, int32_t id) {
+        int left = max(min({p1.x, p2.x, p3.x}), _clip.GetLeft());
+        int right = min(max({p1.x, p2.x, p3.x}), _clip.GetRight());
+        int top = max(min({p1.y, p2.y, p3.y}), _clip.GetTop());
+        int bottom = min(max({p1.y, p2.y, p3.y}), _clip.GetBottom());
+        for(int row = top; row <= bottom; row++) {
+            for(int col = left; col <= right; col++) {
+                if(pointInTriangle(wxPoint(col, row), p1, p2, p3)) {
+                    _ids[(size_t)row * _width + col] = id;
+                }
+            }
+        }
+    };
+};
+
 // Класс для фигур
 class Figure
 {
 private:
     int _x, _y, _z;
     unsigned long _color;
+    // Номер снимка сцены, в который фигура уже попала
+    unsigned _snapshotEpoch = 0;
 public:
     Figure(int x, int y) {
         _x = x;
@@ -152,23 +411,40 @@ public:
         return this->_color;
     };
     void SetX(int x) {
+        beforeShapeChange(this);
         this->_x = x;
     };
     void SetY(int y) {
+        beforeShapeChange(this);
         this->_y = y;
     };
     void SetZ(int z) {
+        beforeFigureChange(this);
         this->_z = z;
     };
     void SetColour(unsigned long color) {
+        beforeFigureChange(this);
         this->_color = color;
     };
+    unsigned GetSnapshotEpoch() {
+        return _snapshotEpoch;
+    };
+    void SetSnapshotEpoch(unsigned epoch) {
+        _snapshotEpoch = epoch;
+    };
 
     static string GetType() { return ""; }
+    virtual uint8_t GetTag() = 0;
+    virtual Figure* Clone(FigureArena& arena) = 0;
     virtual double CalcArea() { return 0; };
     virtual string Show() { return ""; };
+    // Рисует фигуру кистью её цвета, перо для всех фигур задаёт render
     virtual void Draw(wxDC&  dc) = 0;
+    // Рисование номера фигуры в буфер выбора, повторяет Draw
+    virtual void DrawIds(PickBuffer& buffer, int32_t id) = 0;
     virtual bool IsClicked(int x, int y) { return false; };
+    // Прямоугольник, который занимает фигура на канвасе
+    virtual wxRect GetBounds() { return wxRect(GetX(), GetY(), 1, 1); };
     virtual void Save(ofstream& f)
     {
         f << GetX() << endl;
@@ -177,13 +453,8 @@ public:
         f << GetColour() << endl;
     };
 
-    void Load(ifstream& f)
-    {
-        f >> _x;
-        f >> _y;
-        f >> _z;
-        f >> _color;
-    };
+    // Координаты, Z и цвет пишет сама сцена, фигура пишет только свои размеры
+    virtual void SaveCompact(CompactWriter& w) {};
 };
 
 // Класс для кругов
@@ -195,11 +466,8 @@ public:
     Circle(int x, int y, float r, unsigned long color): Figure(x,y,color) {
         _r = r;
     };
-    Circle(ifstream& f): Figure(0,0,0) {
-        Load(f);
-    };
-    Circle(Circle &copy): Circle(copy.GetX(), copy.GetY(), copy.GetRadius(), copy.GetColour()) {
-        SetZ(copy.GetZ());
+    Circle(Circle &copy): Figure(copy) {
+        _r = copy.GetRadius();
     };
     void operator=(Circle* other) {
         Figure::operator=((Figure*)other);
@@ -214,13 +482,27 @@ public:
     static string GetType() {
         return "круг";
     };
+    static const uint8_t TAG = 1;
+    // Радиус должен быть конечным и неотрицательным, иначе его нельзя привести к целым координатам
+    static bool isValidRadius(float r) {
+        return isfinite(r) && r >= 0;
+    };
+    uint8_t GetTag() {
+        return TAG;
+    };
+    Figure* Clone(FigureArena& arena) {
+        return (Figure*)arena.Create<Circle>(*this);
+    };
     void Draw(wxDC&  dc) {
         brush->SetColour(wxColour(GetColour()));
         dc.SetBrush(*brush); 
-        dc.SetPen( wxPen( wxColor(0,0,0), 1 ) ); 
         dc.DrawCircle( wxPoint(GetX(), GetY()), GetRadius());
     };
+    void DrawIds(PickBuffer& buffer, int32_t id) {
+        buffer.FillCircle(GetX(), GetY(), GetRadius(), id);
+    };
     void SetRadius(float r) {
+        beforeShapeChange(this);
         this->_r = r;
     };
     float GetRadius() {
@@ -229,14 +511,17 @@ public:
     bool IsClicked(int x, int y) {
         return sqrt(pow(x-GetX(), 2) + pow(y-GetY(), 2)) <= GetRadius();
     };
+    wxRect GetBounds() {
+        int r = GetRadius();
+        return wxRect(GetX() - r, GetY() - r, r*2 + 1, r*2 + 1);
+    };
     void Save(ofstream& f) {
         f << GetType() << endl;
         Figure::Save(f);
         f << GetRadius() << endl;
     };
-    void Load(ifstream& f) {
-        Figure::Load(f);
-        f >> _r;
+    void SaveCompact(CompactWriter& w) {
+        w.PutFloat(GetRadius());
     };
 };
 
@@ -250,11 +535,9 @@ public:
         _w = w;
         _h = h;
     };
-    Rectangle(ifstream& f): Figure(0,0,0) {
-        Load(f);
-    };
-    Rectangle(Rectangle &copy): Rectangle(copy.GetX(), copy.GetY(), copy.GetWidth(), copy.GetHeight(), copy.GetColour()) {
-        SetZ(copy.GetZ());
+    Rectangle(Rectangle &copy): Figure(copy) {
+        _w = copy.GetWidth();
+        _h = copy.GetHeight();
     };
     void operator=(Rectangle* other) {
         Figure::operator=((Figure*)other);
@@ -270,37 +553,53 @@ public:
     static string GetType() {
         return "прямоугольник";
     };
+    static const uint8_t TAG = 2;
+    static bool isValidSizes(int w, int h) {
+        return w >= 0 && h >= 0;
+    };
+    uint8_t GetTag() {
+        return TAG;
+    };
+    Figure* Clone(FigureArena& arena) {
+        return (Figure*)arena.Create<Rectangle>(*this);
+    };
     void Draw(wxDC&  dc) {
         brush->SetColour(wxColour(GetColour()));
         dc.SetBrush(*brush); 
-        dc.SetPen( wxPen( wxColor(0,0,0), 1 ) ); 
         dc.DrawRectangle( GetX() - GetWidth() / 2, GetY() - GetHeight() / 2, GetWidth(), GetHeight());
     };
+    void DrawIds(PickBuffer& buffer, int32_t id) {
+        buffer.FillRect(GetX() - GetWidth() / 2, GetY() - GetHeight() / 2, GetWidth(), GetHeight(), id);
+    };
     int GetWidth() {
         return _w;
     };
     void SetWidth(int w) {
+        beforeShapeChange(this);
         _w = w;
     };
     int GetHeight() {
         return _h;
     };
     void SetHeight(int h) {
+        beforeShapeChange(this);
         _h = h;
     };
     bool IsClicked(int x, int y) {
         return abs(x-GetX()) <= GetWidth() / 2 && abs(y-GetY()) <= GetHeight() / 2;
     };
+    wxRect GetBounds() {
+        return wxRect(GetX() - GetWidth() / 2, GetY() - GetHeight() / 2, GetWidth(), GetHeight());
+    };
     void Save(ofstream& f) {
         f << GetType() << endl;
         Figure::Save(f);
         f << GetWidth() << endl;
         f << GetHeight() << endl;
     };
-    void Load(ifstream& f) {
-        Figure::Load(f);
-        f >> _w;
-        f >> _h;
+    void SaveCompact(CompactWriter& w) {
+        w.PutSigned(GetWidth());
+        w.PutSigned(GetHeight());
     };
 };
 
@@ -316,12 +615,10 @@ public:
         _c = c;
         checkSizes();
     };
-    Triangle(ifstream& f): Figure(0,0,0) {
-        Load(f);
-        checkSizes();
-    };
-    Triangle(Triangle &copy): Triangle(copy.GetX(), copy.GetY(), copy.GetA(), copy.GetB(), copy.GetC(), copy.GetColour()) {
-        SetZ(copy.GetZ());
+    Triangle(Triangle &copy): Figure(copy) {
+        _a = copy.GetA();
+        _b = copy.GetB();
+        _c = copy.GetC();
     };
     void operator=(Triangle* other) {
         Figure::operator=((Figure*)other);
@@ -330,10 +627,18 @@ public:
         SetC(other->GetC());
     };
     
+    // Проверка без исключения, чтобы загрузчики могли отбросить запись до создания фигуры
+    // Сторона a должна быть больше нуля: на неё делится расчёт вершин в GetTrianglePoints
+    static bool isValidSizes(int a, int b, int c) {
+        if(a <= 0) {
+            return false;
+        }
+        int minc = min(abs(a-b), abs(b-a));
+        int maxc = a+b;
+        return !(c < minc || c > maxc);
+    };
     void checkSizes() {
-        int minc = min(abs(_a-_b), abs(_b-_a));
-        int maxc = _a+_b;
-        if(_c < minc || _c > maxc) {
+        if(!isValidSizes(_a, _b, _c)) {
             throw WrongTriangleSizeException(_a,_b,_c);
         }
     };
@@ -347,6 +652,13 @@ public:
     static string GetType() {
         return "треугольник";
     };
+    static const uint8_t TAG = 3;
+    uint8_t GetTag() {
+        return TAG;
+    };
+    Figure* Clone(FigureArena& arena) {
+        return (Figure*)arena.Create<Triangle>(*this);
+    };
     wxPoint *GetTrianglePoints() {
         wxPoint *points = new wxPoint[3];
         points[0] = wxPoint(GetX(),GetY());
@@ -361,16 +673,22 @@ public:
     void Draw(wxDC&  dc) {
         brush->SetColour(wxColour(GetColour()));
         dc.SetBrush(*brush); 
-        dc.SetPen( wxPen( wxColor(0,0,0), 1 ) ); 
-        
+
         wxPoint *points = GetTrianglePoints();
         dc.DrawPolygon(3, points);
-        delete points;
+        delete[] points;
+    };
+    // Те же целочисленные вершины, что и в Draw, поэтому выбор совпадает с нарисованным треугольником
+    void DrawIds(PickBuffer& buffer, int32_t id) {
+        wxPoint *points = GetTrianglePoints();
+        buffer.FillTriangle(points[0], points[1], points[2], id);
+        delete[] points;
     };
     int GetA() {
         return _a;
     };
     void SetA(int a) {
+        beforeShapeChange(this);
         _a = a;
         checkSizes();
     };
@@ -378,6 +696,7 @@ public:
         return _b;
     };
     void SetB(int b) {
+        beforeShapeChange(this);
         _b = b;
         checkSizes();
     }
@@ -385,15 +704,25 @@ public:
         return _c;
     };
     void SetC(int c) {
+        beforeShapeChange(this);
         _c = c;
         checkSizes();
     };
     bool IsClicked(int x, int y) {
         wxPoint *points = GetTrianglePoints();
         bool result = pointInTriangle(wxPoint(x,y), points[0], points[1], points[2]);
-        delete points;
+        delete[] points;
         return result;        
     };
+    wxRect GetBounds() {
+        wxPoint *points = GetTrianglePoints();
+        int left = min({points[0].x, points[1].x, points[2].x});
+        int top = min({points[0].y, points[1].y, points[2].y});
+        int right = max({points[0].x, points[1].x, points[2].x});
+        int bottom = max({points[0].y, points[1].y, points[2].y});
+        delete[] points;
+        return wxRect(left, top, right - left + 1, bottom - top + 1);
+    };
     void Save(ofstream& f) {
         f << GetType() << endl;
         Figure::Save(f);
@@ -401,18 +730,29 @@ public:
         f << GetB() << endl;
         f << GetC() << endl;
     };
-    void Load(ifstream& f) {
-        Figure::Load(f);
-        f >> _a;
-        f >> _b;
-        f >> _c;
+    void SaveCompact(CompactWriter& w) {
+        w.PutSigned(GetA());
+        w.PutSigned(GetB());
+        w.PutSigned(GetC());
     };
 };
 
-const int MAX_SIZE = 255;
+const int MAX_SIZE = 100000;
 const string FILE_NAME = "figures.txt";
+const string COMPACT_FILE_NAME = "figures.bin";
+const string AUTOSAVE_FILE_NAME = "figures.autosave.txt";
+// Интервал автосохранения в секундах по умолчанию (0 - выключено),
+// включается переменной окружения FIGURES_AUTOSAVE, см. README.md
+const int AUTOSAVE_INTERVAL = 0;
+// Сигнатура и версия компактного формата
+const char COMPACT_MAGIC[] = {'F', 'I', 'G', 'S', 1};
 Figure* figures[MAX_SIZE];
 int figuresCount = 0;
+// Память всех фигур сцены
+FigureArena sceneArena;
+// Номер сцены, увеличивается при каждой очистке: арена выдаёт новым фигурам те же адреса,
+// поэтому по указателю нельзя отличить новую фигуру от старой
+unsigned sceneGeneration = 0;
 // Ссылка на перемещаемую фигуру
 Figure* movingFigure = nullptr;
 // Ссылка на фигуру, находящуюся под курсором
@@ -422,6 +762,197 @@ int ddX, ddY;
 // Координаты мыши на канвасе
 int mouseX = 0, mouseY = 0;
 
+// Снимок сцены для сохранения в фоне
+// Создаётся за O(1): запоминает только массив и количество фигур.
+// Пока снимок активен, фигура перед первым изменением копируется в арену снимка (копирование при записи),
+// а фоновый поток берёт копию, если она есть, иначе копирует живую фигуру и помечает её как сохранённую.
+// Под блокировкой только копирование, запись в файл идёт без неё, чтобы медленный диск не тормозил изменения фигур
+class SceneSnapshot
+{
+private:
+    Figure** _figures;
+    int _count;
+    unsigned _epoch;
+    mutex _mutex;
+    FigureArena _copies;
+    unordered_map<Figure*, Figure*> _originals;
+    // Копия записываемой фигуры, используется только фоновым потоком
+    FigureArena _scratch;
+public:
+    SceneSnapshot(Figure** figures, int count, unsigned epoch): _figures(figures), _count(count), _epoch(epoch) {};
+    int GetCount() {
+        return _count;
+    };
+    // Вызывает visit для фигуры i в том состоянии, в котором она была в момент снимка
+    void Visit(int i, const function<void(Figure*)> &visit) {
+        Figure *state;
+        {
+            lock_guard<mutex> lock(_mutex);
+            Figure *figure = _figures[i];
+            auto original = _originals.find(figure);
+            if(original != _originals.end()) {
+                // Копии после создания не меняются, их можно читать без блокировки
+                state = original->second;
+            } else {
+                _scratch.Clear();
+                state = figure->Clone(_scratch);
+                figure->SetSnapshotEpoch(_epoch);
+            }
+        }
+        visit(state);
+    };
+    // Сохраняет копию фигуры, если она ещё не попала в снимок
+    void BeforeChange(Figure* figure) {
+        lock_guard<mutex> lock(_mutex);
+        if(figure->GetSnapshotEpoch() == _epoch) {
+            return;
+        }
+        _originals[figure] = figure->Clone(_copies);
+        figure->SetSnapshotEpoch(_epoch);
+    };
+};
+
+// Снимок, который сейчас записывается в фоне
+atomic<SceneSnapshot*> activeSnapshot = nullptr;
+
+// Буфер выбора для точного поиска фигуры под курсором, включается флажком
+PickBuffer pickBuffer;
+bool usePickBuffer = false;
+// Идёт ли анимация: пока фигуры движутся, буфер выбора пришлось бы перерисовывать целиком каждый кадр
+bool animationRunning = false;
+
+void beforeFigureChange(Figure* figure) {
+    SceneSnapshot *snapshot = activeSnapshot.load(memory_order_acquire);
+    if(snapshot) {
+        snapshot->BeforeChange(figure);
+    }
+};
+
+void beforeShapeChange(Figure* figure) {
+    beforeFigureChange(figure);
+    if(usePickBuffer) {
+        pickBuffer.Invalidate(figure);
+    }
+};
+
+void PickBuffer::Invalidate(Figure* figure) {
+    if(_dirtyAll || animationRunning) {
+        InvalidateAll();
+        return;
+    }
+    // При очень большом числе изменений (например, в анимации) дешевле перерисовать весь буфер
+    if(_changed.size() >= 4096) {
+        InvalidateAll();
+        return;
+    }
+    addDamage(figure->GetBounds());
+    _changed.push_back(figure);
+};
+
+void PickBuffer::update(Figure** figures, int figuresCount) {
+    if(!_dirtyAll && _changed.empty() && _damage.IsEmpty()) {
+        return;
+    }
+    for(Figure *figure : _changed) {
+        addDamage(figure->GetBounds());
+    }
+    wxRect canvas(0, 0, _width, _height);
+    _clip = _dirtyAll ? canvas : _damage.Inflate(1).Intersect(canvas);
+    _damage = wxRect();
+    _changed.clear();
+    _dirtyAll = false;
+    if(_clip.IsEmpty()) {
+        return;
+    }
+
+    FillRect(_clip.GetLeft(), _clip.GetTop(), _clip.GetWidth(), _clip.GetHeight(), 0);
+    // Индексы фигур по Z, рисуем от дальней к ближней, как render
+    vector<int> byZ(figuresCount, -1);
+    for(int i = 0; i < figuresCount; i++) {
+        int z = figures[i]->GetZ();
+        if(z >= 0 && z < figuresCount && byZ[z] < 0) {
+            byZ[z] = i;
+        }
+    }
+    for(int z = figuresCount-1; z >= 0; z--) {
+        int i = byZ[z];
+        if(i >= 0 && figures[i]->GetBounds().Intersects(_clip)) {
+            figures[i]->DrawIds(*this, i + 1);
+        }
+    }
+};
+
+void saveFigures(SceneSnapshot &snapshot, const string &fileName);
+
+// Сохранение сцены в отдельном потоке
+// Об окончании сообщает событием wxEVT_THREAD с номером SAVE_Thread: в строке события текст ошибки, пустой при успехе
+class BackgroundSaver
+{
+private:
+    thread _thread;
+    atomic<bool> _running = false;
+    unsigned _epoch = 0;
+    unique_ptr<SceneSnapshot> _snapshot;
+public:
+    ~BackgroundSaver() {
+        Wait();
+    };
+    bool IsRunning() {
+        return _running;
+    };
+    // Возвращает false, если предыдущее сохранение ещё не закончилось
+    bool Start(Figure** figures, int figuresCount, const string &fileName, wxEvtHandler* handler, int id) {
+        if(_running) {
+            return false;
+        }
+        Wait();
+        _snapshot = make_unique<SceneSnapshot>(figures, figuresCount, ++_epoch);
+        activeSnapshot.store(_snapshot.get(), memory_order_release);
+        _running = true;
+        _thread = thread([this, fileName, handler, id]() {
+            string error;
+            try {
+                saveFigures(*_snapshot, fileName);
+            } catch (const SaveException &e) {
+                error = e.getError();
+            }
+            activeSnapshot.store(nullptr, memory_order_release);
+            _running = false;
+            wxThreadEvent *event = new wxThreadEvent(wxEVT_THREAD, id);
+            event->SetString(wxString::FromUTF8(error));
+            wxQueueEvent(handler, event);
+        });
+        return true;
+    };
+    // Дожидается окончания сохранения, нужно перед удалением фигур
+    void Wait() {
+        if(_thread.joinable()) {
+            _thread.join();
+        }
+        _snapshot.reset();
+    };
+};
+
+BackgroundSaver backgroundSaver;
+
+// Вывод занятой фигурами памяти
+void printMemoryUsage() {
+    cout << fmt::format("Фигур в памяти: {}, занято {} байт из {}",
+        sceneArena.GetCount(), sceneArena.GetUsedBytes(), sceneArena.GetReservedBytes()) << endl;
+};
+
+// Удаление всех фигур сцены
+void clearFigures(int &figuresCount) {
+    // Фоновое сохранение читает фигуры из арены, освобождать её можно только после него
+    backgroundSaver.Wait();
+    figuresCount = 0;
+    movingFigure = nullptr;
+    focusFigure = nullptr;
+    sceneArena.Clear();
+    sceneGeneration++;
+    pickBuffer.InvalidateAll();
+};
+
 // Перемещение выбранной фигуры вперед по оси Z
 void moveToFront(Figure** figures, int figuresCount, Figure* figure) {
     for(int i = 0; i < figuresCount; i++) {
@@ -430,10 +961,230 @@ void moveToFront(Figure** figures, int figuresCount, Figure* figure) {
         }
     }
     figure->SetZ(0);
+    // Остальные фигуры сохраняют взаимный порядок, в буфере выбора меняется только область перенесённой
+    if(usePickBuffer) {
+        pickBuffer.Invalidate(figure);
+    }
+};
+
+// Фигуры в порядке Z: result[z] - первая фигура с таким Z или nullptr
+// Позволяет обходить фигуры по Z за один проход вместо перебора массива для каждого Z
+vector<Figure*> figuresByZ(Figure** figures, int figuresCount) {
+    vector<Figure*> result(figuresCount, nullptr);
+    for(int i = 0; i < figuresCount; i++) {
+        int z = figures[i]->GetZ();
+        if(z >= 0 && z < figuresCount && !result[z]) {
+            result[z] = figures[i];
+        }
+    }
+    return result;
 };
 
+// Постоянные рабочие потоки для parallelFor
+// Потоки создаются один раз и ждут задания, поэтому шаг анимации не тратит время на их запуск
+class WorkerPool
+{
+private:
+    vector<thread> _workers;
+    mutex _mutex;
+    condition_variable _wake, _done;
+    // Номер задания: рабочий поток берётся за задание, когда номер меняется
+    unsigned _job = 0;
+    bool _stop = false;
+    int _active = 0;
+    const function<void(int, int)> *_body = nullptr;
+    int _count = 0, _chunks = 0, _chunk = 0;
+    atomic<int> _nextChunk = 0;
+    // Задания выполняются по одному
+    mutex _runMutex;
+
+    void runChunks() {
+        for(int i = _nextChunk++; i < _chunks; i = _nextChunk++) {
+            (*_body)(i * _chunk, min(_count, (i + 1) * _chunk));
+        }
+    };
+    void work() {
+        unsigned job = 0;
+        while(true) {
+            unique_lock<mutex> lock(_mutex);
+            _wake.wait(lock, [&]() { return _stop || _job != job; });
+            if(_stop) {
+                return;
+            }
+            job = _job;
+            lock.unlock();
+            runChunks();
+            lock.lock();
+            if(--_active == 0) {
+                _done.notify_one();
+            }
+        }
+    };
+public:
+    WorkerPool(int threads) {
+        for(int i = 0; i < threads; i++) {
+            _workers.emplace_back(&WorkerPool::work, this);
+        }
+    };
+    ~WorkerPool() {
+        {
+            lock_guard<mutex> lock(_mutex);
+            _stop = true;
+        }
+        _wake.notify_all();
+        for(auto &worker : _workers) {
+            worker.join();
+        }
+    };
+    // Число потоков вместе с вызывающим
+    int GetThreads() {
+        return _workers.size() + 1;
+    };
+    // Делит [0, count) на chunks частей и выполняет их на рабочих потоках и в текущем
+    void Run(int count, int chunks, const function<void(int, int)> &body) {
+        lock_guard<mutex> run(_runMutex);
+        {
+            lock_guard<mutex> lock(_mutex);
+            _body = &body;
+            _count = count;
+            _chunks = chunks;
+            _chunk = (count + chunks - 1) / chunks;
+            _nextChunk = 0;
+            _active = _workers.size();
+            _job++;
+        }
+        _wake.notify_all();
+        runChunks();
+        unique_lock<mutex> lock(_mutex);
+        _done.wait(lock, [&]() { return _active == 0; });
+    };
+};
+
+// Выполняет body(begin, end) для частей диапазона [0, count) на всех ядрах
+// Части меньше minChunk не выделяются, маленькие диапазоны считаются в текущем потоке
+void parallelFor(int count, int minChunk, const function<void(int, int)> &body) {
+    static WorkerPool pool(max(1u, thread::hardware_concurrency()) - 1);
+    int threads = min(pool.GetThreads(), count / max(1, minChunk));
+    if(threads <= 1) {
+        body(0, count);
+        return;
+    }
+    pool.Run(count, threads, body);
+};
+
+// Анимация фигур с фиксированным шагом времени
+// Положения и скорости хранятся в непрерывных массивах, индекс совпадает с индексом фигуры в figures.
+// Шаг считается параллельно только по массивам, в фигуры положения переносятся в основном потоке
+class FigureAnimation
+{
+private:
+    // Фигура, для которой заполнен элемент массивов
+    vector<Figure*> _owners;
+    // Сцена, для которой заполнены массивы; после очистки или загрузки все элементы заполняются заново
+    unsigned _generation = 0;
+    vector<float> _x, _y, _vx, _vy;
+    // Границы фигуры относительно её центра
+    vector<int> _left, _top, _right, _bottom;
+public:
+    static constexpr float MAX_SPEED = 150;
+
+    // Подстраивает массивы под текущие фигуры, новым фигурам задаёт случайную скорость
+    void Sync(Figure** figures, int figuresCount, Figure* movingFigure) {
+        if(_generation != sceneGeneration) {
+            _generation = sceneGeneration;
+            _owners.clear();
+        }
+        _owners.resize(figuresCount, nullptr);
+        _x.resize(figuresCount);
+        _y.resize(figuresCount);
+        _vx.resize(figuresCount);
+        _vy.resize(figuresCount);
+        _left.resize(figuresCount);
+        _top.resize(figuresCount);
+        _right.resize(figuresCount);
+        _bottom.resize(figuresCount);
+        for(int i = 0; i < figuresCount; i++) {
+            Figure *figure = figures[i];
+            bool fresh = _owners[i] != figure;
+            if(fresh) {
+                _owners[i] = figure;
+                _vx[i] = MAX_SPEED * (rand() % 2001 - 1000) / 1000;
+                _vy[i] = MAX_SPEED * (rand() % 2001 - 1000) / 1000;
+                wxRect bounds = figure->GetBounds();
+                _left[i] = bounds.GetLeft() - figure->GetX();
+                _top[i] = bounds.GetTop() - figure->GetY();
+                _right[i] = bounds.GetRight() - figure->GetX();
+                _bottom[i] = bounds.GetBottom() - figure->GetY();
+            }
+            // Фигура могла быть сдвинута мышью, тогда анимация продолжается с нового места
+            if(fresh || figure == movingFigure || (int)_x[i] != figure->GetX() || (int)_y[i] != figure->GetY()) {
+                _x[i] = figure->GetX();
+                _y[i] = figure->GetY();
+            }
+        }
+    };
+
+    // Один шаг на dt секунд, при bounce фигуры отскакивают от краёв канваса maxX, maxY
+    void Step(float dt, bool bounce, int maxX, int maxY, Figure* movingFigure) {
+        parallelFor(_x.size(), 4096, [&](int begin, int end) {
+            for(int i = begin; i < end; i++) {
+                if(_owners[i] == movingFigure) {
+                    continue;
+                }
+                _x[i] += _vx[i] * dt;
+                _y[i] += _vy[i] * dt;
+                if(!bounce) {
+                    continue;
+                }
+                if(_x[i] + _left[i] < 0) {
+                    _x[i] = -_left[i];
+                    _vx[i] = abs(_vx[i]);
+                } else if(_x[i] + _right[i] > maxX) {
+                    _x[i] = maxX - _right[i];
+                    _vx[i] = -abs(_vx[i]);
+                }
+                if(_y[i] + _top[i] < 0) {
+                    _y[i] = -_top[i];
+                    _vy[i] = abs(_vy[i]);
+                } else if(_y[i] + _bottom[i] > maxY) {
+                    _y[i] = maxY - _bottom[i];
+                    _vy[i] = -abs(_vy[i]);
+                }
+            }
+        });
+    };
+
+    // Переносит положения из массивов в фигуры
+    void Apply(Figure** figures, int figuresCount) {
+        for(int i = 0; i < figuresCount && i < (int)_x.size(); i++) {
+            Figure *figure = figures[i];
+            int x = _x[i], y = _y[i];
+            if(figure->GetX() != x) {
+                figure->SetX(x);
+            }
+            if(figure->GetY() != y) {
+                figure->SetY(y);
+            }
+        }
+    };
+};
+
+// Шаг симуляции в секундах, не зависит от частоты перерисовки
+const float ANIMATION_STEP = 1.0f / 120;
+// Частота перерисовки во время анимации, кадров в секунду
+const int ANIMATION_FPS = 60;
+FigureAnimation animation;
+bool animationBounce = true;
+// Время, которое ещё не обсчитано шагами симуляции
+double animationLag = 0;
+chrono::steady_clock::time_point animationTime;
+
 // Добавление фигуры в массив
 void addFigure(Figure** figures, int &figuresCount, Figure* figure) {
+    if(figuresCount >= MAX_SIZE) {
+        cout << "Достигнуто максимальное количество фигур" << endl;
+        return;
+    }
     for(int i = 0; i < figuresCount; i++) {
         figures[i]->SetZ(figures[i]->GetZ()+1);
     }
@@ -441,18 +1192,23 @@ void addFigure(Figure** figures, int &figuresCount, Figure* figure) {
 
     figures[figuresCount] = figure;
     figuresCount++;
+    // Новая фигура лежит поверх остальных, их взаимный порядок не изменился
+    if(usePickBuffer) {
+        pickBuffer.Invalidate(figure);
+    }
 };
 
-void saveFigures(Figure** figures, int figuresCount) {
+// Запись figuresCount фигур в текстовый файл, saveFigure(i, f) записывает фигуру i
+void saveFigures(const string &fileName, int figuresCount, const function<void(int, ofstream&)> &saveFigure) {
     ofstream f;
     try
     {
         f.exceptions(ofstream::failbit | ofstream::badbit);
-        f.open(FILE_NAME);
+        f.open(fileName);
         f.exceptions(std::ofstream::goodbit);
 
         for(int i = 0; i < figuresCount; i++) {
-            figures[i]->Save(f);
+            saveFigure(i, f);
         }
     }
     catch(ofstream::failure const &ex)
@@ -461,50 +1217,501 @@ void saveFigures(Figure** figures, int figuresCount) {
         throw SaveException(ex.what());
     }
     f.close();
+    if(!f) {
+        throw SaveException(fmt::format("не удалось записать {}", fileName));
+    }
 };
 
-void loadFigures(Figure** figures, int &figuresCount) {
-    ifstream f = ifstream(FILE_NAME);
-    if(!f) {
-        cout << "Загрузить не удалось" << endl;  
-        return;
+// Запись снимка сцены, вызывается из фонового потока
+void saveFigures(SceneSnapshot &snapshot, const string &fileName) {
+    saveFigures(fileName, snapshot.GetCount(), [&snapshot](int i, ofstream &f) {
+        snapshot.Visit(i, [&f](Figure *figure) {
+            figure->Save(f);
+        });
+    });
+};
+
+// Данные одной фигуры, прочитанные из файла, до создания объекта
+struct FigureRecord
+{
+    uint8_t tag = 0;
+    int x = 0, y = 0, z = 0;
+    unsigned long color = 0;
+    float r = 0;
+    int w = 0, h = 0;
+    int a = 0, b = 0, c = 0;
+    // Строка файла, с которой начинается запись
+    int line = 0;
+};
+
+// Создание фигуры по прочитанной записи в арене сцены
+// Размеры треугольника должны быть проверены заранее через Triangle::isValidSizes
+Figure* createFigure(const FigureRecord &record) {
+    Figure *figure = nullptr;
+    switch(record.tag) {
+    case Circle::TAG:
+        figure = (Figure*)sceneArena.Create<Circle>(record.x, record.y, record.r, record.color);
+        break;
+    case Rectangle::TAG:
+        figure = (Figure*)sceneArena.Create<Rectangle>(record.x, record.y, record.w, record.h, record.color);
+        break;
+    case Triangle::TAG:
+        figure = (Figure*)sceneArena.Create<Triangle>(record.x, record.y, record.a, record.b, record.c, record.color);
+        break;
     }
-    
-    figuresCount = 0;
-    try {
-    while(!f.eof())
-    {
-        string type;
-        f >> type;
-        if(type == "") {
-            break;
+    figure->SetZ(record.z);
+    return figure;
+};
+
+// Ошибка в записи файла сцены
+struct LoadError
+{
+    int line;
+    string message;
+};
+
+// Разбор текстового файла сцены целиком из буфера в памяти
+// Работает без потоков ввода и без исключений: каждая запись проверяется полностью,
+// все ошибки собираются с номерами строк, после ошибки разбор продолжается со следующего типа фигуры
+class FigureTextParser
+{
+private:
+    const char* _pos;
+    const char* _end;
+    // Конец всего файла; если разбирается часть файла, за _end начинается следующая запись
+    const char* _fileEnd;
+    int _line = 1;
+    // Строка последнего прочитанного слова
+    int _tokenLine = 1;
+
+    bool nextToken(string_view &token) {
+        while(_pos < _end && (*_pos == ' ' || *_pos == '\n' || *_pos == '\r' || *_pos == '\t')) {
+            if(*_pos == '\n') {
+                _line++;
+            }
+            _pos++;
+        }
+        if(_pos == _end) {
+            return false;
+        }
+        const char *start = _pos;
+        while(_pos < _end && !(*_pos == ' ' || *_pos == '\n' || *_pos == '\r' || *_pos == '\t')) {
+            _pos++;
+        }
+        token = string_view(start, _pos - start);
+        _tokenLine = _line;
+        return true;
+    };
+
+    template<typename T>
+    bool readNumber(T &value, const char *name, vector<LoadError> &errors) {
+        string_view token;
+        if(!nextToken(token)) {
+            if(_end < _fileEnd) {
+                // Часть файла закончилась на названии типа следующей записи,
+                // сообщаем ту же ошибку, что и при разборе файла целиком
+                const char *next = _end;
+                while(next < _fileEnd && !(*next == ' ' || *next == '\n' || *next == '\r' || *next == '\t')) {
+                    next++;
+                }
+                errors.push_back({_line, fmt::format("неверное значение \"{}\": {}", name, string_view(_end, next - _end))});
+                return false;
+            }
+            errors.push_back({_line, fmt::format("файл закончился, ожидалось значение \"{}\"", name)});
+            return false;
+        }
+        auto [end, ec] = from_chars(token.data(), token.data() + token.size(), value);
+        if(ec != errc() || end != token.data() + token.size()) {
+            errors.push_back({_tokenLine, fmt::format("неверное значение \"{}\": {}", name, token)});
+            // Возможно это уже начало следующей записи, возвращаемся к нему
+            if(tagForType(token)) {
+                _pos = token.data();
+                _line = _tokenLine;
+            }
+            return false;
         }
+        return true;
+    };
 
-        Figure *figure;
-        if(type == Circle::GetType()) {
-            Circle *circle = new Circle(f);
-            figure = (Figure*)circle;
+    bool readRecord(FigureRecord &record, vector<LoadError> &errors) {
+        if(!readNumber(record.x, "x", errors)) return false;
+        if(!readNumber(record.y, "y", errors)) return false;
+        if(!readNumber(record.z, "z", errors)) return false;
+        if(!readNumber(record.color, "цвет", errors)) return false;
+        switch(record.tag) {
+        case Circle::TAG:
+            if(!readNumber(record.r, "радиус", errors)) {
+                return false;
+            }
+            if(!Circle::isValidRadius(record.r)) {
+                errors.push_back({record.line, fmt::format("неверный радиус круга: {}", record.r)});
+                return false;
+            }
+            return true;
+        case Rectangle::TAG:
+            if(!readNumber(record.w, "ширина", errors)
+                || !readNumber(record.h, "высота", errors)) {
+                return false;
+            }
+            if(!Rectangle::isValidSizes(record.w, record.h)) {
+                errors.push_back({record.line, fmt::format("неверные размеры прямоугольника: {}, {}", record.w, record.h)});
+                return false;
+            }
+            return true;
+        case Triangle::TAG:
+            if(!readNumber(record.a, "a", errors)
+                || !readNumber(record.b, "b", errors)
+                || !readNumber(record.c, "c", errors)) {
+                return false;
+            }
+            if(!Triangle::isValidSizes(record.a, record.b, record.c)) {
+                errors.push_back({record.line, WrongTriangleSizeException(record.a, record.b, record.c).getError()});
+                return false;
+            }
+            return true;
         }
-        else if(type == Rectangle::GetType()) {
-            Rectangle *rectangle = new Rectangle(f);
-            figure = (Figure*)rectangle;
+        return false;
+    };
+public:
+    FigureTextParser(const char* begin, const char* end, const char* fileEnd = nullptr): _pos(begin), _end(end), _fileEnd(fileEnd ? fileEnd : end) {};
+
+    // Тип фигуры по названию, 0 если название неизвестно
+    static uint8_t tagForType(string_view type) {
+        static const string circle = Circle::GetType();
+        static const string rectangle = Rectangle::GetType();
+        static const string triangle = Triangle::GetType();
+        if(type == circle) return Circle::TAG;
+        if(type == rectangle) return Rectangle::TAG;
+        if(type == triangle) return Triangle::TAG;
+        return 0;
+    };
+
+    // Начало первой записи на границе или после from: строка, состоящая из названия типа фигуры.
+    // Нужна, чтобы делить файл на части для параллельного разбора; если записей дальше нет, возвращает end
+    static const char* findRecordStart(const char* from, const char* begin, const char* end) {
+        const char *line = from;
+        // Если from попал в середину строки, начинаем со следующей
+        if(line != begin && line[-1] != '\n') {
+            line = (const char*)memchr(line, '\n', end - line);
+            line = line ? line + 1 : end;
         }
-        else if(type == Triangle::GetType()) {
-            Triangle *triangle = new Triangle(f);
-            figure = (Figure*)triangle;
+        while(line < end) {
+            const char *lineEnd = (const char*)memchr(line, '\n', end - line);
+            if(!lineEnd) {
+                lineEnd = end;
+            }
+            const char *tokenEnd = lineEnd;
+            while(tokenEnd > line && (tokenEnd[-1] == '\r' || tokenEnd[-1] == ' ' || tokenEnd[-1] == '\t')) {
+                tokenEnd--;
+            }
+            if(tagForType(string_view(line, tokenEnd - line))) {
+                return line;
+            }
+            line = lineEnd < end ? lineEnd + 1 : end;
         }
-        else {
-            throw WrongFigureTypeException(type);
+        return end;
+    };
+
+    // Добавляет корректные записи в records, ошибки - в errors
+    void Parse(vector<FigureRecord> &records, vector<LoadError> &errors) {
+        string_view token;
+        bool skipping = false;
+        while(nextToken(token)) {
+            FigureRecord record;
+            record.tag = tagForType(token);
+            if(!record.tag) {
+                // Подряд идущий мусор после ошибки сообщаем один раз
+                if(!skipping) {
+                    errors.push_back({_tokenLine, WrongFigureTypeException(string(token)).getError()});
+                    skipping = true;
+                }
+                continue;
+            }
+            skipping = false;
+            record.line = _tokenLine;
+            if(readRecord(record, errors)) {
+                records.push_back(record);
+            } else {
+                skipping = true;
+            }
         }
-        if(figure) {
-            figures[figuresCount] = figure;
-            figuresCount++;
+    };
+};
+
+// Разбор текстового файла сцены на всех ядрах
+// Файл делится на части по строкам с названием типа фигуры, каждая часть разбирается в свой список,
+// затем списки склеиваются в порядке файла, поэтому фигуры, ошибки и номера строк такие же, как при разборе одним потоком.
+// Части разбираются волнами по числу потоков: как только набрано limit записей, остаток файла не разбирается
+void parseFiguresParallel(const char* begin, const char* end, vector<FigureRecord> &records, vector<LoadError> &errors, size_t limit = SIZE_MAX) {
+    // Части меньше этого размера не стоят передачи в отдельный поток,
+    // а больше - слишком много разбирается зря, если limit набирается раньше конца волны
+    const size_t minChunkSize = 256 << 10;
+    const size_t maxChunkSize = 16 << 20;
+    int threads = max(1u, thread::hardware_concurrency());
+    size_t chunkSize = clamp((size_t)(end - begin) / threads, minChunkSize, maxChunkSize);
+
+    int lineOffset = 0;
+    const char *pos = begin;
+    while(pos < end && records.size() < limit) {
+        vector<const char*> bounds = {pos};
+        while((int)bounds.size() <= threads && bounds.back() < end) {
+            const char *last = bounds.back();
+            bounds.push_back((size_t)(end - last) > chunkSize ? FigureTextParser::findRecordStart(last + chunkSize, begin, end) : end);
+        }
+        int chunks = bounds.size() - 1;
+
+        vector<vector<FigureRecord>> chunkRecords(chunks);
+        vector<vector<LoadError>> chunkErrors(chunks);
+        vector<int> chunkLines(chunks);
+        parallelFor(chunks, 1, [&](int first, int last) {
+            for(int i = first; i < last; i++) {
+                FigureTextParser parser(bounds[i], bounds[i+1], end);
+                parser.Parse(chunkRecords[i], chunkErrors[i]);
+                chunkLines[i] = count(bounds[i], bounds[i+1], '\n');
+            }
+        });
+
+        // Номера строк в частях считаются с 1, сдвигаем их на число строк в предыдущих частях
+        for(int i = 0; i < chunks && records.size() < limit; i++) {
+            for(auto &record : chunkRecords[i]) {
+                record.line += lineOffset;
+                records.push_back(record);
+            }
+            for(auto &error : chunkErrors[i]) {
+                error.line += lineOffset;
+                errors.push_back(error);
+            }
+            lineOffset += chunkLines[i];
         }
+        pos = bounds.back();
     }
-    } catch (...) {
-        f.close();
-        throw;
+};
+
+// Приводит Z к значениям 0..n-1 с сохранением порядка,
+// иначе фигуры с пропущенными или повторными Z не будут нарисованы
+void normalizeZ(vector<FigureRecord> &records) {
+    vector<int> order(records.size());
+    for(size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&records](int a, int b) {
+        return records[a].z < records[b].z;
+    });
+    for(size_t z = 0; z < order.size(); z++) {
+        records[order[z]].z = z;
+    }
+};
+
+// Результат разбора файла сцены: корректные записи и ошибки
+struct LoadResult
+{
+    bool opened = false;
+    vector<FigureRecord> records;
+    vector<LoadError> errors;
+};
+
+// Чтение и разбор текстового файла сцены, текущая сцена не меняется
+LoadResult readFigures(const string &fileName) {
+    LoadResult result;
+    ifstream f(fileName, ios::binary);
+    if(!f) {
+        cout << "Загрузить не удалось" << endl;
+        return result;
+    }
+    result.opened = true;
+    std::string data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    f.close();
+
+    // Одна лишняя запись нужна, чтобы узнать, что фигур больше MAX_SIZE, и где файл обрезается
+    parseFiguresParallel(data.data(), data.data() + data.size(), result.records, result.errors, MAX_SIZE + 1);
+    if(result.records.size() > (size_t)MAX_SIZE) {
+        int line = result.records[MAX_SIZE].line;
+        // Ошибки после обрезанного места не относятся к загружаемой сцене
+        erase_if(result.errors, [line](const LoadError &error) { return error.line >= line; });
+        result.errors.push_back({line, fmt::format("слишком много фигур, будут загружены первые {}", MAX_SIZE)});
+        result.records.resize(MAX_SIZE);
+    }
+
+    for(auto &error : result.errors) {
+        cout << fmt::format("{}:{}: {}", fileName, error.line, error.message) << endl;
     }
+    return result;
+};
+
+// Текст для LoadException: число ошибок и первые из них
+string describeLoadErrors(const vector<LoadError> &errors) {
+    const size_t shown = 10;
+    string message = fmt::format("ошибок в файле: {}", errors.size());
+    for(size_t i = 0; i < min(shown, errors.size()); i++) {
+        message += fmt::format("\nстрока {}: {}", errors[i].line, errors[i].message);
+    }
+    if(errors.size() > shown) {
+        message += "\n...";
+    }
+    return message;
+};
+
+// Замена сцены фигурами из уже проверенных записей
+void setFigures(Figure** figures, int &figuresCount, vector<FigureRecord> &records) {
+    normalizeZ(records);
+    // Старая сцена освобождается целиком, её память займут новые фигуры
+    clearFigures(figuresCount);
+    for(auto &record : records) {
+        figures[figuresCount] = createFigure(record);
+        figuresCount++;
+    }
+    printMemoryUsage();
+};
+
+// Код Мортона для координат: соседние на экране фигуры оказываются рядом в файле,
+// поэтому разности координат между записями получаются маленькими
+uint32_t mortonCode(int x, int y) {
+    auto spread = [](uint32_t v) {
+        v &= 0xFFFF;
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spread((uint32_t)(x + 0x8000)) | (spread((uint32_t)(y + 0x8000)) << 1);
+};
+
+// Сохранение в компактном двоичном формате:
+// сигнатура, таблица цветов, затем фигуры в порядке кода Мортона.
+// Каждая фигура - байт типа, разности координат с предыдущей фигурой (zig-zag varint),
+// Z, номер цвета в таблице и размеры фигуры
+void saveFiguresCompact(Figure** figures, int figuresCount) {
+    vector<Figure*> order(figures, figures + figuresCount);
+    sort(order.begin(), order.end(), [](Figure *a, Figure *b) {
+        return mortonCode(a->GetX(), a->GetY()) < mortonCode(b->GetX(), b->GetY());
+    });
+
+    // Частые цвета получают меньшие номера и занимают меньше байт
+    unordered_map<unsigned long, int> usage;
+    for(Figure *figure : order) {
+        usage[figure->GetColour()]++;
+    }
+    vector<unsigned long> palette;
+    palette.reserve(usage.size());
+    for(auto &entry : usage) {
+        palette.push_back(entry.first);
+    }
+    sort(palette.begin(), palette.end(), [&usage](unsigned long a, unsigned long b) {
+        return usage[a] != usage[b] ? usage[a] > usage[b] : a < b;
+    });
+    unordered_map<unsigned long, int> paletteIndex;
+    for(size_t i = 0; i < palette.size(); i++) {
+        paletteIndex[palette[i]] = i;
+    }
+
+    CompactWriter w;
+    w.PutBytes(COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+    w.PutVarint(palette.size());
+    for(unsigned long color : palette) {
+        w.PutVarint(color);
+    }
+    w.PutVarint(order.size());
+    int prevX = 0, prevY = 0;
+    for(Figure *figure : order) {
+        w.PutByte(figure->GetTag());
+        w.PutSigned((int64_t)figure->GetX() - prevX);
+        w.PutSigned((int64_t)figure->GetY() - prevY);
+        w.PutVarint(figure->GetZ());
+        w.PutVarint(paletteIndex[figure->GetColour()]);
+        figure->SaveCompact(w);
+        prevX = figure->GetX();
+        prevY = figure->GetY();
+    }
+
+    ofstream f(COMPACT_FILE_NAME, ios::binary);
+    if(!f) {
+        throw SaveException(fmt::format("не удалось открыть {}", COMPACT_FILE_NAME));
+    }
+    f.write(w.GetData().data(), w.GetData().size());
+    if(!f) {
+        throw SaveException(fmt::format("не удалось записать {}", COMPACT_FILE_NAME));
+    }
+};
+
+// Загрузка из компактного формата
+// Сначала читаются и проверяются все записи, фигуры создаются только если файл целиком корректен
+void loadFiguresCompact(Figure** figures, int &figuresCount) {
+    ifstream f(COMPACT_FILE_NAME, ios::binary);
+    if(!f) {
+        cout << "Загрузить не удалось" << endl;
+        return;
+    }
+    std::string data((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    f.close();
+
+    CompactReader r(data);
+    if(!r.Expect(COMPACT_MAGIC, sizeof(COMPACT_MAGIC))) {
+        throw LoadException(fmt::format("{} не является сохранённой сценой", COMPACT_FILE_NAME));
+    }
+    uint64_t paletteSize = r.GetVarint();
+    if(paletteSize > data.size()) {
+        throw LoadException("повреждена таблица цветов");
+    }
+    vector<unsigned long> palette(paletteSize);
+    for(auto &color : palette) {
+        color = r.GetVarint();
+    }
+    uint64_t count = r.GetVarint();
+    if(count > (uint64_t)MAX_SIZE) {
+        throw LoadException(fmt::format("слишком много фигур: {}", count));
+    }
+
+    vector<FigureRecord> records(count);
+    int64_t prevX = 0, prevY = 0;
+    for(auto &record : records) {
+        record.tag = r.GetByte();
+        prevX += r.GetSigned();
+        prevY += r.GetSigned();
+        record.x = prevX;
+        record.y = prevY;
+        record.z = r.GetVarint();
+        uint64_t colorIndex = r.GetVarint();
+        if(colorIndex >= palette.size()) {
+            throw LoadException(fmt::format("неверный номер цвета: {}", colorIndex));
+        }
+        record.color = palette[colorIndex];
+        switch(record.tag) {
+        case Circle::TAG:
+            record.r = r.GetFloat();
+            if(!Circle::isValidRadius(record.r)) {
+                throw LoadException(fmt::format("неверный радиус круга: {}", record.r));
+            }
+            break;
+        case Rectangle::TAG:
+            record.w = r.GetSigned();
+            record.h = r.GetSigned();
+            if(!Rectangle::isValidSizes(record.w, record.h)) {
+                throw LoadException(fmt::format("неверные размеры прямоугольника: {}, {}", record.w, record.h));
+            }
+            break;
+        case Triangle::TAG:
+            record.a = r.GetSigned();
+            record.b = r.GetSigned();
+            record.c = r.GetSigned();
+            if(!Triangle::isValidSizes(record.a, record.b, record.c)) {
+                throw LoadException(WrongTriangleSizeException(record.a, record.b, record.c).getError());
+            }
+            break;
+        default:
+            throw LoadException(fmt::format("неизвестный тип фигуры: {}", record.tag));
+        }
+    }
+
+    // Z в файле могут повторяться или выходить за пределы, такие фигуры не были бы нарисованы
+    normalizeZ(records);
+    // Старая сцена освобождается целиком, её память займут новые фигуры
+    clearFigures(figuresCount);
+    for(auto &record : records) {
+        figures[figuresCount] = createFigure(record);
+        figuresCount++;
+    }
+    printMemoryUsage();
 };
 
 // Добавляет круг случайного радиуса и по случайным координатам
@@ -514,7 +1721,7 @@ void addRandomCircle(int maxX, int maxY) {
     int x = minRadius + rand() % max(1, maxX - minRadius*2);
     int y = minRadius + rand() % max(1, maxY - minRadius*2);
     int radius = minRadius + rand() % (max(1, min({x, y, maxX - x, maxY - y}) - minRadius));
-    Circle *circle = new Circle(x,y,radius,rand());
+    Circle *circle = sceneArena.Create<Circle>(x,y,radius,rand());
     cout << circle->Show() << endl;
     addFigure(figures, figuresCount, (Figure*)circle);
 };
@@ -528,7 +1735,7 @@ void addRandomRectangle(int maxX, int maxY) {
     int width = minSize + rand() % (max(1, min({x, maxX - x}) - minSize));
     int height = minSize + rand() % (max(1, min({y, maxY - y}) - minSize));
 
-    Rectangle *rectangle = new Rectangle(x,y,width*2,height*2,rand());
+    Rectangle *rectangle = sceneArena.Create<Rectangle>(x,y,width*2,height*2,rand());
     cout << rectangle->Show() << endl;
     addFigure(figures, figuresCount, (Figure*)rectangle);
 };
@@ -545,7 +1752,7 @@ void addRandomTriangle(int maxX, int maxY) {
     int maxc = a+b;
     int c = minc + (rand() % (maxc-minc));
 
-    Triangle *triangle = new Triangle(x,y,a,b,c,rand());
+    Triangle *triangle = sceneArena.Create<Triangle>(x,y,a,b,c,rand());
     cout << triangle->Show() << endl;
     addFigure(figures, figuresCount, (Figure*)triangle);
 };
@@ -554,7 +1761,10 @@ void addRandomTriangle(int maxX, int maxY) {
 class BasicDrawPane : public wxPanel
 {
 public:
-    BasicDrawPane(wxFrame* parent) : wxPanel(parent) {};
+    BasicDrawPane(wxFrame* parent) : wxPanel(parent) {
+        // Фон рисует сам render, это нужно для wxAutoBufferedPaintDC
+        SetBackgroundStyle(wxBG_STYLE_PAINT);
+    };
     
     void paintEvent(wxPaintEvent & evt);
     void paintNow();
@@ -602,6 +1812,21 @@ public:
     void OnTriangleBtnClick( wxCommandEvent& event );
     void OnSaveBtnClick( wxCommandEvent& event );
     void OnLoadBtnClick( wxCommandEvent& event );
+    void OnSaveCompactBtnClick( wxCommandEvent& event );
+    void OnLoadCompactBtnClick( wxCommandEvent& event );
+    void OnClearBtnClick( wxCommandEvent& event );
+    void OnSaveDone( wxThreadEvent& event );
+    void OnAutosaveTimer( wxTimerEvent& event );
+    void OnAnimationBtnClick( wxCommandEvent& event );
+    void OnBounceCheck( wxCommandEvent& event );
+    void OnPickBufferCheck( wxCommandEvent& event );
+    void OnAnimationTimer( wxTimerEvent& event );
+
+    wxTimer autosaveTimer;
+    // Нажато сохранение, пока шло другое; выполняется после его окончания
+    bool savePending = false;
+    wxTimer animationTimer;
+    virtual int OnExit();
 
     DECLARE_EVENT_TABLE()
 };
@@ -613,6 +1838,15 @@ enum
     BUTTON_Triangle = wxID_HIGHEST + 3,
     BUTTON_Save = wxID_HIGHEST + 4,
     BUTTON_Load = wxID_HIGHEST + 5,
+    BUTTON_SaveCompact = wxID_HIGHEST + 6,
+    BUTTON_LoadCompact = wxID_HIGHEST + 7,
+    BUTTON_Clear = wxID_HIGHEST + 8,
+    SAVE_Thread = wxID_HIGHEST + 9,
+    TIMER_Autosave = wxID_HIGHEST + 10,
+    BUTTON_Animation = wxID_HIGHEST + 11,
+    CHECK_Bounce = wxID_HIGHEST + 12,
+    TIMER_Animation = wxID_HIGHEST + 13,
+    CHECK_PickBuffer = wxID_HIGHEST + 14,
 };
 
 IMPLEMENT_APP(MyApp)
@@ -625,12 +1859,22 @@ bool MyApp::OnInit()
     drawPane = new BasicDrawPane( (wxFrame*) frame );
 
     // Блок для отображения кнопок
-    wxGridSizer *gs = new wxGridSizer(2, 3, 3, 3);
+    wxGridSizer *gs = new wxGridSizer(4, 3, 3, 3);
     gs->Add(new wxButton((wxFrame*) frame, BUTTON_Circle, _T("Круг")), 0, wxEXPAND);
     gs->Add(new wxButton((wxFrame*) frame, BUTTON_Rectangle, _T("Прямоугольник")), 0, wxEXPAND);
     gs->Add(new wxButton((wxFrame*) frame, BUTTON_Triangle, _T("Треугольник")), 0, wxEXPAND);
     gs->Add(new wxButton((wxFrame*) frame, BUTTON_Save, _T("Сохранить")), 0, wxEXPAND);
     gs->Add(new wxButton((wxFrame*) frame, BUTTON_Load, _T("Загрузить")), 0, wxEXPAND);
+    gs->Add(new wxButton((wxFrame*) frame, BUTTON_SaveCompact, _T("Сохранить сжато")), 0, wxEXPAND);
+    gs->Add(new wxButton((wxFrame*) frame, BUTTON_LoadCompact, _T("Загрузить сжатое")), 0, wxEXPAND);
+    gs->Add(new wxButton((wxFrame*) frame, BUTTON_Clear, _T("Очистить")), 0, wxEXPAND);
+    gs->Add(new wxButton((wxFrame*) frame, BUTTON_Animation, _T("Анимация")), 0, wxEXPAND);
+    wxCheckBox *bounceCheck = new wxCheckBox((wxFrame*) frame, CHECK_Bounce, _T("Отскок от краёв"));
+    bounceCheck->SetValue(animationBounce);
+    gs->Add(bounceCheck, 0, wxEXPAND);
+    wxCheckBox *pickCheck = new wxCheckBox((wxFrame*) frame, CHECK_PickBuffer, _T("Точный выбор"));
+    pickCheck->SetValue(usePickBuffer);
+    gs->Add(pickCheck, 0, wxEXPAND);
 
     // Блок - вертикальная колонка 
     wxBoxSizer* sizer = new wxBoxSizer(wxVERTICAL);
@@ -643,6 +1887,18 @@ bool MyApp::OnInit()
     frame->SetAutoLayout(true);
 	
     frame->Show();
+
+    // Автосохранение через тот же фоновый путь, что и кнопка сохранения
+    int autosaveInterval = AUTOSAVE_INTERVAL;
+    wxString intervalEnv;
+    if(wxGetEnv("FIGURES_AUTOSAVE", &intervalEnv)) {
+        autosaveInterval = wxAtoi(intervalEnv);
+    }
+    animationTimer.SetOwner(this, TIMER_Animation);
+    if(autosaveInterval > 0) {
+        autosaveTimer.SetOwner(this, TIMER_Autosave);
+        autosaveTimer.Start(autosaveInterval * 1000);
+    }
     return true;
 };
 
@@ -660,6 +1916,15 @@ BEGIN_EVENT_TABLE ( MyApp, wxApp )
     EVT_BUTTON ( BUTTON_Triangle, MyApp::OnTriangleBtnClick ) 
     EVT_BUTTON ( BUTTON_Save, MyApp::OnSaveBtnClick ) 
     EVT_BUTTON ( BUTTON_Load, MyApp::OnLoadBtnClick ) 
+    EVT_BUTTON ( BUTTON_SaveCompact, MyApp::OnSaveCompactBtnClick ) 
+    EVT_BUTTON ( BUTTON_LoadCompact, MyApp::OnLoadCompactBtnClick ) 
+    EVT_BUTTON ( BUTTON_Clear, MyApp::OnClearBtnClick ) 
+    EVT_THREAD ( SAVE_Thread, MyApp::OnSaveDone )
+    EVT_TIMER ( TIMER_Autosave, MyApp::OnAutosaveTimer )
+    EVT_BUTTON ( BUTTON_Animation, MyApp::OnAnimationBtnClick ) 
+    EVT_CHECKBOX ( CHECK_Bounce, MyApp::OnBounceCheck )
+    EVT_CHECKBOX ( CHECK_PickBuffer, MyApp::OnPickBufferCheck )
+    EVT_TIMER ( TIMER_Animation, MyApp::OnAnimationTimer )
 END_EVENT_TABLE() 
 
 void BasicDrawPane::mouseMoved(wxMouseEvent& event) {
@@ -678,18 +1943,15 @@ void BasicDrawPane::mouseMoved(wxMouseEvent& event) {
     Figure *f = nullptr;
     if(movingFigure) {
         f = movingFigure;
+    } else if(usePickBuffer && !animationRunning) {
+        pickBuffer.Resize(GetSize().GetWidth(), GetSize().GetHeight());
+        f = pickBuffer.Pick(mouseX, mouseY, figures, figuresCount);
     } else {
-        for(int z = 0; z < figuresCount; z++) {
-            if(f) {
+        for(Figure *figure : figuresByZ(figures, figuresCount)) {
+            if(figure && figure->IsClicked(mouseX, mouseY)) {
+                f = figure;
                 break;
             }
-            for(int i = 0; i < figuresCount; i++) {
-                Figure *figure = figures[i];
-                if(figure->GetZ() == z && figure->IsClicked(mouseX, mouseY)) {
-                    f = figure;
-                    break;
-                }
-            }
         }
     }
 
@@ -732,28 +1994,30 @@ void BasicDrawPane::rightClick(wxMouseEvent& event) {
 
 void BasicDrawPane::paintEvent(wxPaintEvent & evt)
 {
-    wxPaintDC dc(this);
-    render(dc);// Рисуем подсказку к фигуре в виде обведенного текста
+    // Рисуем во внеэкранный буфер и выводим его целиком, чтобы канвас не мерцал
+    wxAutoBufferedPaintDC dc(this);
+    render(dc);
 };
 
 void BasicDrawPane::paintNow()
 {
-    wxClientDC dc(this);
-    render(dc);
+    Refresh(false);
+    Update();
 };
 
 void BasicDrawPane::render(wxDC&  dc)
 {
     // Очистка канваса
+    dc.SetBackground(wxBrush(GetBackgroundColour()));
     dc.Clear();
-    // Рисуем фигруы по очереди, начиная с дальнего Z к ближнему
+    // Перо одно для всех фигур, задаём его один раз за кадр
+    dc.SetPen( wxPen( wxColor(0,0,0), 1 ) );
+    // Рисуем фигруы по очереди, начиная с дальнего Z к ближнему, пропуская фигуры за пределами канваса
+    wxRect canvas(wxPoint(0, 0), GetClientSize());
+    vector<Figure*> byZ = figuresByZ(figures, figuresCount);
     for(int z = figuresCount-1; z >= 0; z--) {
-        for(int i = 0; i < figuresCount; i++) {
-            Figure *figure = figures[i];
-            if(figure->GetZ() == z) {
-                figure->Draw(dc);
-                break;
-            }   
+        if(byZ[z] && byZ[z]->GetBounds().Intersects(canvas)) {
+            byZ[z]->Draw(dc);
         }
     }
 
@@ -809,15 +2073,126 @@ void MyApp::OnTriangleBtnClick( wxCommandEvent& event ) {
 
 void MyApp::OnSaveBtnClick( wxCommandEvent& event ) {
     cout << "Сохранение" << endl;
-    saveFigures(figures, figuresCount);
+    // Если ещё идёт предыдущее сохранение или автосохранение, не ждём его:
+    // сохранение последнего состояния запустится из OnSaveDone
+    if(!backgroundSaver.Start(figures, figuresCount, FILE_NAME, this, SAVE_Thread)) {
+        cout << "Сохранение начнётся после текущего" << endl;
+        savePending = true;
+    }
 };
 
 void MyApp::OnLoadBtnClick( wxCommandEvent& event ) {
     cout << "Загрузка" << endl;
-    try {
-        loadFigures(figures, figuresCount);
-    } catch (const WrongFigureTypeException &error) {
-        throw LoadException(error.getError());
+    // Файл разбирается один раз: при ошибках загружаются уже проверенные записи, а не файл заново
+    LoadResult result = readFigures(FILE_NAME);
+    if(!result.opened) {
+        return;
+    }
+    if(!result.errors.empty()) {
+        // Предлагаем загрузить хотя бы корректные фигуры
+        LoadException error(describeLoadErrors(result.errors));
+        int answer = wxMessageBox(wxString::FromUTF8(error.getError() + "\n\nЗагрузить корректные фигуры?"),
+            _T("Ошибка загрузки"), wxYES_NO | wxICON_WARNING);
+        if(answer != wxYES) {
+            return;
+        }
     }
+    setFigures(figures, figuresCount, result.records);
+    drawPane->paintNow();
+};
+
+void MyApp::OnSaveCompactBtnClick( wxCommandEvent& event ) {
+    cout << "Сжатое сохранение" << endl;
+    saveFiguresCompact(figures, figuresCount);
+};
+
+void MyApp::OnLoadCompactBtnClick( wxCommandEvent& event ) {
+    cout << "Загрузка сжатой сцены" << endl;
+    loadFiguresCompact(figures, figuresCount);
     drawPane->paintNow();
+};
+
+void MyApp::OnClearBtnClick( wxCommandEvent& event ) {
+    cout << "Очистка" << endl;
+    clearFigures(figuresCount);
+    printMemoryUsage();
+    drawPane->paintNow();
+};
+
+void MyApp::OnSaveDone( wxThreadEvent& event ) {
+    if(event.GetString().IsEmpty()) {
+        cout << "Сохранено" << endl;
+    } else {
+        wxLogError("%s", event.GetString());
+    }
+    // Если между окончанием потока и этим событием уже началось автосохранение,
+    // сохранение остаётся отложенным и запустится после него
+    if(savePending) {
+        savePending = !backgroundSaver.Start(figures, figuresCount, FILE_NAME, this, SAVE_Thread);
+    }
+};
+
+void MyApp::OnAutosaveTimer( wxTimerEvent& event ) {
+    // Если пользователь как раз сохраняет сцену, автосохранение пропускается
+    if(backgroundSaver.Start(figures, figuresCount, AUTOSAVE_FILE_NAME, this, SAVE_Thread)) {
+        cout << "Автосохранение" << endl;
+    }
+};
+
+void MyApp::OnAnimationBtnClick( wxCommandEvent& event ) {
+    if(animationTimer.IsRunning()) {
+        cout << "Анимация остановлена" << endl;
+        animationTimer.Stop();
+        animationRunning = false;
+        return;
+    }
+    cout << "Анимация запущена" << endl;
+    animationLag = 0;
+    animationTime = chrono::steady_clock::now();
+    animationTimer.Start(1000 / ANIMATION_FPS);
+    animationRunning = true;
+};
+
+void MyApp::OnBounceCheck( wxCommandEvent& event ) {
+    animationBounce = event.IsChecked();
+};
+
+void MyApp::OnPickBufferCheck( wxCommandEvent& event ) {
+    usePickBuffer = event.IsChecked();
+    // Пока буфер был выключен, изменения фигур в нём не отмечались
+    pickBuffer.InvalidateAll();
+};
+
+// Кадр анимации: обсчитываем столько фиксированных шагов, сколько прошло времени, и перерисовываем один раз
+void MyApp::OnAnimationTimer( wxTimerEvent& event ) {
+    auto now = chrono::steady_clock::now();
+    animationLag += chrono::duration<double>(now - animationTime).count();
+    animationTime = now;
+
+    int maxX = drawPane->GetSize().GetWidth();
+    int maxY = drawPane->GetSize().GetHeight();
+    animation.Sync(figures, figuresCount, movingFigure);
+    // Если шаги не успевают, отбрасываем отставание, чтобы не копить его бесконечно
+    const int maxSteps = 8;
+    int steps = 0;
+    while(animationLag >= ANIMATION_STEP && steps < maxSteps) {
+        animation.Step(ANIMATION_STEP, animationBounce, maxX, maxY, movingFigure);
+        animationLag -= ANIMATION_STEP;
+        steps++;
+    }
+    if(steps == maxSteps) {
+        animationLag = 0;
+    }
+    if(steps > 0) {
+        animation.Apply(figures, figuresCount);
+        // Без Update: если кадр не успевает, wx объединит перерисовки, а шаги симуляции не отстанут
+        drawPane->Refresh(false);
+    }
+};
+
+int MyApp::OnExit() {
+    autosaveTimer.Stop();
+    animationTimer.Stop();
+    backgroundSaver.Wait();
+    return wxApp::OnExit();
 };
\ No newline at end of file